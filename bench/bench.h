@@ -0,0 +1,74 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Shared helpers for the benchmarks. Each benchmark includes the shell's
+// source directly, with its main renamed, so it measures the real code.
+
+#ifndef SEASHELL_BENCH_H
+#define SEASHELL_BENCH_H
+
+#define main seashell_main
+#include "../seashell.c"
+#undef main
+
+#include <time.h>
+
+double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Data sets come from a fixed seed, so every run measures the same input.
+unsigned int bench_seed = 304;
+
+unsigned int bench_random()
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return bench_seed >> 16;
+}
+
+/**
+ * Reports one measurement. It is printed for reading and, when
+ * SEASHELL_BENCH_RESULTS names a file, appended to it as a JSON line tagged
+ * with SEASHELL_BENCH_COMMIT, so runs of different commits can be compared.
+ */
+void bench_result(const char *bench, const char *metric, double value, const char *unit)
+{
+	printf("%-22s %14.2f %s\n", metric, value, unit);
+	fflush(stdout);
+
+	const char *path = getenv("SEASHELL_BENCH_RESULTS");
+	if (path == NULL || *path == 0) return;
+	FILE *fp = fopen(path, "a");
+	if (fp == NULL) {
+		perror(path);
+		return;
+	}
+	const char *commit = getenv("SEASHELL_BENCH_COMMIT");
+	fprintf(fp, "{\"commit\": \"%s\", \"bench\": \"%s\", \"metric\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}\n",
+			commit ? commit : "", bench, metric, value, unit);
+	fclose(fp);
+}
+
+/**
+ * Points stdout at /dev/null, for timing commands that print
+ * @return descriptor to give back to bench_restore_stdout
+ */
+int bench_silence_stdout()
+{
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO), null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+	return saved;
+}
+
+void bench_restore_stdout(int saved)
+{
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+}
+
+#endif
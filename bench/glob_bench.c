@@ -0,0 +1,89 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Latency benchmark for pathname expansion. For each directory size it fills
+// a directory with that many files, times the first `*`, which reads the
+// directory, then `*` again and a pattern with a literal prefix, which use
+// the cached listing, and a two-level pattern over a tree of directories.
+//
+// Usage: glob_bench [largest entry count] [directory]
+
+#include "bench.h"
+#include <ftw.h>
+
+int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/**
+ * Parses a line with its wildcards expanded, best of a few runs
+ * @return seconds, and the number of words through words
+ */
+double time_glob(const char *text, int runs, int *words)
+{
+	char line[256];
+	double best = 1e9;
+	for (int run = 0; run < runs; run++) {
+		strcpy(line, text);
+		struct command_t *command = arena_calloc(&line_arena, sizeof(struct command_t));
+		double start = now_seconds();
+		parse_command(line, command);
+		double elapsed = now_seconds() - start;
+		*words = command->arg_count;
+		arena_reset(&line_arena);
+		if (elapsed < best) best = elapsed;
+	}
+	return best;
+}
+
+void bench_directory(const char *base, int entry_count)
+{
+	char path[PATH_MAX];
+	for (int i = 0; i < entry_count; i++) {
+		snprintf(path, sizeof(path), "%s/file%07d.log", base, i);
+		close(open(path, O_WRONLY | O_CREAT, 0644));
+	}
+	// A tree of 100 directories holding one matching file each.
+	for (int i = 0; i < 100; i++) {
+		snprintf(path, sizeof(path), "%s/dir%03d", base, i);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/dir%03d/app.log", base, i);
+		close(open(path, O_WRONLY | O_CREAT, 0644));
+	}
+	chdir(base);
+
+	int words;
+	char metric[64];
+	snprintf(metric, sizeof(metric), "first * %d", entry_count);
+	bench_result("glob", metric, time_glob("echo *", 1, &words) * 1e3, "ms");
+	snprintf(metric, sizeof(metric), "* %d", entry_count);
+	bench_result("glob", metric, time_glob("echo *", 5, &words) * 1e3, "ms");
+	snprintf(metric, sizeof(metric), "prefix %d", entry_count);
+	bench_result("glob", metric, time_glob("echo file00001*.log", 200, &words) * 1e6, "us");
+	snprintf(metric, sizeof(metric), "dir*/app.log %d", entry_count);
+	bench_result("glob", metric, time_glob("echo dir*/app.log", 200, &words) * 1e6, "us");
+}
+
+int main(int argc, char **argv)
+{
+	int largest = argc > 1 ? atoi(argv[1]) : 100000;
+	const char *dir = argc > 2 ? argv[2] : "/tmp";
+
+	char *original = getcwd(NULL, 0);
+	printf("glob_bench: up to %d entries\n", largest);
+
+	for (int count = 1000; count <= largest; count *= 10) {
+		char base[PATH_MAX];
+		snprintf(base, sizeof(base), "%s/glob_bench.XXXXXX", dir);
+		if (mkdtemp(base) == NULL) {
+			perror(base);
+			return 1;
+		}
+		bench_directory(base, count);
+		chdir(original);
+		nftw(base, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	}
+
+	free(original);
+	return 0;
+}
@@ -0,0 +1,81 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Throughput benchmark for highlight. Writes a log-like text file made of
+// words from a small vocabulary, then runs the highlight builtin over it with
+// the output sent to /dev/null: streamed on one thread, counting only, and in
+// parallel over the mapped file.
+//
+// Usage: highlight_bench [MiB] [directory]
+
+#include "bench.h"
+
+const char *vocabulary[] = {
+	"info", "debug", "request", "served", "in", "ms", "user", "session",
+	"cache", "miss", "hit", "connection", "closed", "opened", "retry", "queue",
+	"worker", "started", "finished", "job", "path", "/var/lib/data", "status", "ok",
+	"latency", "bytes", "from", "to", "upstream", "downstream", "sent", "received",
+};
+
+// The words searched for, drawn once in every 64 words.
+const char *searched[] = { "warning", "error", "timeout" };
+
+/**
+ * Times one highlight invocation, best of a few runs
+ * @return seconds
+ */
+double time_highlight(char **args, int arg_count)
+{
+	double best = 1e9;
+	for (int run = 0; run < 5; run++) {
+		int saved = bench_silence_stdout();
+		double start = now_seconds();
+		executeHighlight(args, arg_count);
+		double elapsed = now_seconds() - start;
+		bench_restore_stdout(saved);
+		if (elapsed < best) best = elapsed;
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 64) << 20;
+	const char *dir = argc > 2 ? argv[2] : "/tmp";
+
+	// Lines of 4 to 19 words. Searched words are rare enough that most lines
+	// do not match, like a real log.
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/highlight_bench.log", dir);
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+	int words = sizeof(vocabulary) / sizeof(vocabulary[0]);
+	size_t written = 0;
+	while (written < size) {
+		int count = 4 + bench_random() % 16;
+		for (int w = 0; w < count; w++) {
+			unsigned int r = bench_random();
+			const char *word = r % 64 == 0 ? searched[r / 64 % 3] : vocabulary[r / 64 % words];
+			written += fprintf(fp, w ? " %s" : "%s", word);
+		}
+		fputc('\n', fp);
+		written++;
+	}
+	fclose(fp);
+
+	char threads[16];
+	snprintf(threads, sizeof(threads), "%ld", sysconf(_SC_NPROCESSORS_ONLN));
+	char *stream_args[] = { "warning", "y", "error", "r", "timeout", "m", path };
+	char *count_args[] = { "-c", "warning", "y", "error", "r", "timeout", "m", path };
+	char *parallel_args[] = { "-n", "-j", threads, "warning", "y", "error", "r", "timeout", "m", path };
+
+	printf("highlight_bench: %zu MiB, %s threads\n", size >> 20, threads);
+	bench_result("highlight", "highlight", size / time_highlight(stream_args, 7) / 1e6, "MB/s");
+	bench_result("highlight", "highlight -c", size / time_highlight(count_args, 8) / 1e6, "MB/s");
+	bench_result("highlight", "highlight -n -j", size / time_highlight(parallel_args, 10) / 1e6, "MB/s");
+
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,132 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Throughput benchmark for kdiff. Writes two files that differ in a few
+// places, then times the mapped comparison and each compare kernel on its own,
+// and finally the text mode diff of two large, mostly equal text files.
+//
+// Usage: kdiff_bench [MiB] [directory]
+
+#include "bench.h"
+
+typedef void (*scan_kernel)(const unsigned char *, const unsigned char *, size_t,
+		unsigned long long, struct byte_diff_t *);
+
+void write_file(const char *path, const unsigned char *data, size_t size)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, data, size) != (ssize_t)size) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+void report(const char *name, size_t size, double seconds, unsigned long long count)
+{
+	if (count != 16) fprintf(stderr, "kdiff_bench: %s found %llu differing bytes, expected 16\n", name, count);
+	bench_result("kdiff", name, size / seconds / 1e9, "GB/s");
+}
+
+double best_kernel_time(scan_kernel kernel, const unsigned char *a, const unsigned char *b,
+		size_t size, unsigned long long *count)
+{
+	double best = 1e9;
+	for (int run = 0; run < 5; run++) {
+		struct byte_diff_t diff;
+		memset(&diff, 0, sizeof(diff));
+		diff.first = -1;
+		double start = now_seconds();
+		kernel(a, b, size, 0, &diff);
+		double elapsed = now_seconds() - start;
+		if (elapsed < best) best = elapsed;
+		*count = diff.count;
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 256) << 20;
+	const char *dir = argc > 2 ? argv[2] : "/tmp";
+
+	// Deterministic contents with a handful of scattered differences.
+	unsigned char *a = malloc(size), *b = malloc(size);
+	for (size_t i = 0; i < size; i++)
+		a[i] = bench_random();
+	memcpy(b, a, size);
+	for (size_t i = 1; i <= 16; i++)
+		b[size / 17 * i] ^= 0xFF;
+
+	char path1[PATH_MAX], path2[PATH_MAX];
+	snprintf(path1, sizeof(path1), "%s/kdiff_bench_a.bin", dir);
+	snprintf(path2, sizeof(path2), "%s/kdiff_bench_b.bin", dir);
+	write_file(path1, a, size);
+	write_file(path2, b, size);
+
+	printf("kdiff_bench: %zu MiB\n", size >> 20);
+
+	unsigned long long count;
+	double seconds = best_kernel_time(byte_diff_scan_generic, a, b, size, &count);
+	report("generic", size, seconds, count);
+#if defined(__x86_64__)
+	seconds = best_kernel_time(byte_diff_scan_sse2, a, b, size, &count);
+	report("sse2", size, seconds, count);
+	if (__builtin_cpu_supports("avx2")) {
+		seconds = best_kernel_time(byte_diff_scan_avx2, a, b, size, &count);
+		report("avx2", size, seconds, count);
+	}
+#endif
+
+	// The whole kdiff -b path: open, map and scan, with the files in page cache.
+	double best = 1e9;
+	for (int run = 0; run < 5; run++) {
+		struct byte_diff_t diff;
+		memset(&diff, 0, sizeof(diff));
+		int fd1 = open(path1, O_RDONLY), fd2 = open(path2, O_RDONLY);
+		double start = now_seconds();
+		byte_diff_files(fd1, fd2, &diff);
+		double elapsed = now_seconds() - start;
+		close(fd1);
+		close(fd2);
+		if (elapsed < best) best = elapsed;
+		count = diff.count;
+	}
+	report("kdiff -b", size, best, count);
+
+	unlink(path1);
+	unlink(path2);
+	free(a);
+	free(b);
+
+	// Text mode: 200k lines with a few edits, hunks written to /dev/null.
+	snprintf(path1, sizeof(path1), "%s/kdiff_bench_a.txt", dir);
+	snprintf(path2, sizeof(path2), "%s/kdiff_bench_b.txt", dir);
+	FILE *fp1 = fopen(path1, "w"), *fp2 = fopen(path2, "w");
+	for (int i = 0; i < 200000; i++) {
+		unsigned int value = bench_random();
+		fprintf(fp1, "line %d value %u\n", i, value);
+		if (i % 20000 == 7) fprintf(fp2, "edited line %d\n", i);
+		else if (i % 33333 != 5) fprintf(fp2, "line %d value %u\n", i, value);
+	}
+	fclose(fp1);
+	fclose(fp2);
+
+	struct stat st;
+	stat(path1, &st);
+	best = 1e9;
+	for (int run = 0; run < 5; run++) {
+		int saved = bench_silence_stdout();
+		double start = now_seconds();
+		text_diff_files(path1, path2, 3);
+		fflush(stdout);
+		double elapsed = now_seconds() - start;
+		bench_restore_stdout(saved);
+		if (elapsed < best) best = elapsed;
+	}
+	bench_result("kdiff", "kdiff text", st.st_size / best / 1e6, "MB/s");
+	bench_result("kdiff", "kdiff text 200k lines", best * 1e3, "ms");
+
+	unlink(path1);
+	unlink(path2);
+	return 0;
+}
@@ -0,0 +1,49 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Microbenchmark for the command line parser. Parses a mix of typical lines
+// over and over, releasing the line arena after each one like the shell does,
+// and prints lines per second along with the input throughput.
+//
+// Usage: parse_bench [iterations]
+
+#include "bench.h"
+
+const char *sample_lines[] = {
+	"ls -la",
+	"grep -n needle file.txt | sort | uniq -c | sort -rn | head -20",
+	"echo 'single quoted  text' \"double $HOME \\\"quoted\\\"\" escaped\\ space",
+	"make -j8 CFLAGS='-O2 -g' > build.log 2>&1",
+	"cat < input.txt | tr a-z A-Z >> output.txt 2> errors.txt &",
+	"kdiff -r -j 4 left_directory right_directory &> report.txt",
+	"highlight -n -j 4 error r warning y info g /var/log/syslog",
+	NULL
+};
+
+int main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+	char buffer[1024];
+	size_t bytes = 0;
+	long lines = 0;
+
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		for (int l = 0; sample_lines[l]; l++) {
+			// Parsing modifies the line, so each round works on a fresh copy.
+			size_t length = strlen(sample_lines[l]);
+			memcpy(buffer, sample_lines[l], length + 1);
+			struct command_t *command = arena_calloc(&line_arena, sizeof(struct command_t));
+			parse_command(buffer, command);
+			arena_reset(&line_arena);
+			bytes += length;
+			lines++;
+		}
+	}
+	double elapsed = now_seconds() - start;
+
+	printf("parse_bench: %ld lines\n", lines);
+	bench_result("parse", "parse", lines / elapsed, "lines/s");
+	bench_result("parse", "parse throughput", bytes / elapsed / 1e6, "MB/s");
+	bench_result("parse", "parse latency", elapsed / lines * 1e9, "ns");
+	return 0;
+}
@@ -0,0 +1,87 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Compares a builtin loaded from a plugin with the same tool run as a
+// program. Runs the example wcount plugin and the wcount executable built
+// from the same source over a small and a larger file, as shell lines with
+// the output sent to /dev/null, and prints commands per second for each.
+//
+// Usage: plugin_bench [iterations] [plugin directory]
+
+#include "bench.h"
+
+/**
+ * Runs a shell line over and over
+ * @return lines per second
+ */
+double run_line(const char *text, int iterations)
+{
+	char line[PATH_MAX * 2];
+	int saved = bench_silence_stdout();
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		strcpy(line, text);
+		struct command_t *command = arena_calloc(&line_arena, sizeof(struct command_t));
+		parse_command(line, command);
+		process_command(command);
+		arena_reset(&line_arena);
+	}
+	double elapsed = now_seconds() - start;
+	bench_restore_stdout(saved);
+	return iterations / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+	variables_init();
+	char *directory = realpath(argc > 2 ? argv[2] : "plugins", NULL);
+	if (directory == NULL) {
+		perror("plugin_bench: plugins");
+		return 1;
+	}
+
+	char library[PATH_MAX], program[PATH_MAX], small[PATH_MAX], large[PATH_MAX];
+	snprintf(library, sizeof(library), "%s/wcount.so", directory);
+	snprintf(program, sizeof(program), "%s/wcount", directory);
+	snprintf(small, sizeof(small), "/tmp/plugin_bench_small.txt");
+	snprintf(large, sizeof(large), "/tmp/plugin_bench_large.txt");
+
+	// Text files of 4 KiB and 1 MiB, lines of random lowercase words.
+	const char *paths[] = { small, large };
+	size_t sizes[] = { 4 << 10, 1 << 20 };
+	for (int f = 0; f < 2; f++) {
+		FILE *fp = fopen(paths[f], "w");
+		for (size_t written = 0; written < sizes[f]; written++) {
+			unsigned int r = bench_random();
+			fputc(r % 13 == 0 ? '\n' : r % 6 == 0 ? ' ' : 'a' + r % 26, fp);
+		}
+		fclose(fp);
+	}
+
+	init_jobs();
+	char *enable_args[] = { "-f", library, "wcount" };
+	executeEnable(enable_args, 3);
+	if (!is_builtin("wcount")) return 1;
+
+	printf("plugin_bench: %d runs of wcount\n", iterations);
+	const char *names[] = { "4k", "1m" };
+	for (int f = 0; f < 2; f++) {
+		char line[PATH_MAX * 2], metric[64];
+		snprintf(line, sizeof(line), "wcount %s", paths[f]);
+		double plugin = run_line(line, iterations);
+		snprintf(line, sizeof(line), "%s %s", program, paths[f]);
+		double forked = run_line(line, iterations);
+
+		snprintf(metric, sizeof(metric), "plugin %s", names[f]);
+		bench_result("plugin", metric, plugin, "commands/s");
+		snprintf(metric, sizeof(metric), "fork+exec %s", names[f]);
+		bench_result("plugin", metric, forked, "commands/s");
+		snprintf(metric, sizeof(metric), "plugin speedup %s", names[f]);
+		bench_result("plugin", metric, plugin / forked, "x");
+	}
+
+	unlink(small);
+	unlink(large);
+	free(directory);
+	return 0;
+}
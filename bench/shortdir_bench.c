@@ -0,0 +1,83 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Latency benchmark for shortdir jump. For each store size it writes a
+// .shortdir log of that many aliases, each for its own directory, and times
+// the first jump, which loads the log, and then jumps to random aliases,
+// which only check that the log is unchanged.
+//
+// Usage: shortdir_bench [largest alias count] [directory]
+
+#include "bench.h"
+#include <ftw.h>
+
+int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/**
+ * Times jumps in a store of the given size
+ * @param base empty directory to build the store in
+ */
+void bench_store(const char *base, int alias_count)
+{
+	free(main_directory);
+	main_directory = strdup(base);
+
+	char *file_path = shortdir_path(".shortdir");
+	FILE *fp = fopen(file_path, "w");
+	char directory[PATH_MAX];
+	for (int i = 0; i < alias_count; i++) {
+		snprintf(directory, sizeof(directory), "%s/d%d", base, i);
+		mkdir(directory, 0755);
+		fprintf(fp, "%s a%d\n", directory, i);
+	}
+	fclose(fp);
+	free(file_path);
+
+	char alias[32];
+	char *args[] = { "jump", alias };
+	snprintf(alias, sizeof(alias), "a%d", alias_count / 2);
+	double start = now_seconds();
+	executeShortdir(args, 2);
+	double first = now_seconds() - start;
+
+	int jumps = 20000;
+	start = now_seconds();
+	for (int i = 0; i < jumps; i++) {
+		snprintf(alias, sizeof(alias), "a%u", bench_random() % alias_count);
+		executeShortdir(args, 2);
+	}
+	double warm = (now_seconds() - start) / jumps;
+
+	char metric[64];
+	snprintf(metric, sizeof(metric), "first jump %d", alias_count);
+	bench_result("shortdir", metric, first * 1e6, "us");
+	snprintf(metric, sizeof(metric), "jump %d", alias_count);
+	bench_result("shortdir", metric, warm * 1e6, "us");
+}
+
+int main(int argc, char **argv)
+{
+	int largest = argc > 1 ? atoi(argv[1]) : 10000;
+	const char *dir = argc > 2 ? argv[2] : "/tmp";
+
+	char *original = getcwd(NULL, 0);
+	main_directory = strdup(original);
+	printf("shortdir_bench: up to %d aliases\n", largest);
+
+	for (int count = 100; count <= largest; count *= 10) {
+		char base[PATH_MAX];
+		snprintf(base, sizeof(base), "%s/shortdir_bench.XXXXXX", dir);
+		if (mkdtemp(base) == NULL) {
+			perror(base);
+			return 1;
+		}
+		bench_store(base, count);
+		chdir(original);
+		nftw(base, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	}
+
+	free(original);
+	return 0;
+}
@@ -0,0 +1,92 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Microbenchmark for the process launcher. Launches `true` repeatedly through
+// fork+exec and through posix_spawn and prints commands per second for each,
+// then runs it as a shell line to show what parsing and job handling add,
+// and with an argument from a command substitution of a builtin and of a
+// program.
+// The shell's heap is grown first, since that is what makes fork expensive.
+//
+// Usage: spawn_bench [iterations] [heap MiB]
+
+#include "bench.h"
+
+double run_launcher(int mode, const char *path, int iterations)
+{
+	char *argv[] = { "true", NULL };
+	struct launch_t launch = { path, argv, { -1, -1, -1 } };
+
+	launch_mode = mode;
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		pid_t pid = launch_process(&launch);
+		if (pid < 0) {
+			perror("launch");
+			exit(1);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	return iterations / (now_seconds() - start);
+}
+
+/**
+ * Runs a line the way a batch does: parsed, looked up, launched and waited
+ * for as a job
+ * @return lines per second
+ */
+double run_shell_line(const char *text, int iterations)
+{
+	char line[PATH_MAX * 2];
+	launch_mode = LAUNCH_SPAWN;
+	init_jobs();
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		strcpy(line, text);
+		struct command_t *command = arena_calloc(&line_arena, sizeof(struct command_t));
+		parse_command(line, command);
+		process_command(command);
+		arena_reset(&line_arena);
+	}
+	return iterations / (now_seconds() - start);
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+	size_t heap_mib = argc > 2 ? atoi(argv[2]) : 256;
+	variables_init();
+
+	const char *path = find_executable("true");
+	if (path == NULL) {
+		fprintf(stderr, "spawn_bench: true not found in PATH\n");
+		return 1;
+	}
+
+	// Touching every page so it is really mapped, like a long-lived shell heap.
+	char *heap = malloc(heap_mib << 20);
+	for (size_t i = 0; i < (heap_mib << 20); i += 4096)
+		heap[i] = 1;
+
+	double forked = run_launcher(LAUNCH_FORK, path, iterations);
+	double spawned = run_launcher(LAUNCH_SPAWN, path, iterations);
+	// By its path, since `true` alone is a builtin.
+	double shell = run_shell_line(path, iterations);
+
+	char line[PATH_MAX * 2];
+	const char *echo = find_executable("echo");
+	snprintf(line, sizeof(line), "true $(%s x)", echo ? echo : "/bin/echo");
+	double substituted_builtin = run_shell_line("true $(echo x)", iterations);
+	double substituted_program = run_shell_line(line, iterations);
+
+	printf("spawn_bench: %d launches of %s with %zu MiB heap\n", iterations, path, heap_mib);
+	bench_result("spawn", "fork+exec", forked, "commands/s");
+	bench_result("spawn", "posix_spawn", spawned, "commands/s");
+	bench_result("spawn", "posix_spawn latency", 1e6 / spawned, "us");
+	bench_result("spawn", "shell line", shell, "commands/s");
+	bench_result("spawn", "shell line overhead", 1e6 / shell - 1e6 / spawned, "us");
+	bench_result("spawn", "substitution builtin", substituted_builtin, "commands/s");
+	bench_result("spawn", "substitution program", substituted_program, "commands/s");
+
+	free(heap);
+	return 0;
+}
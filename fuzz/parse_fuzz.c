@@ -0,0 +1,182 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Fuzz target for the command line parser. Every line that parses is written
+// back with each word single quoted and parsed again; both parses have to
+// agree on the words, redirects and flags of every stage. Command
+// substitutions are not run; each one stands for the text inside it.
+//
+// Built with -DSEASHELL_LIBFUZZER it is a libFuzzer target. Otherwise it is
+// a standalone driver that runs the files given as arguments, or random lines
+// over the parser's special characters.
+//
+// Usage: parse_fuzz [iterations | file...]
+
+#include "../bench/bench.h"
+#include <stdint.h>
+
+/**
+ * Appends a word in single quotes, a quote inside it as '\''
+ */
+char *quote_word(char *out, const char *word)
+{
+	*out++ = '\'';
+	for (; *word; word++) {
+		if (*word == '\'') {
+			memcpy(out, "'\\''", 4);
+			out += 4;
+		} else {
+			*out++ = *word;
+		}
+	}
+	*out++ = '\'';
+	return out;
+}
+
+/**
+ * Writes a parsed pipeline back as a line that should parse the same way
+ */
+void unparse(struct command_t *command, char *out)
+{
+	static const char *operators[] = { "<", ">", ">>", "2>", "2>>" };
+
+	// Never empty, an empty line is not parsed at all.
+	*out++ = ' ';
+	for (struct command_t *c = command; c; c = c->next) {
+		for (int i = 0; c->argv[i]; i++) {
+			out = quote_word(out, c->argv[i]);
+			*out++ = ' ';
+		}
+		// Where 2>&1 goes decides which stdout stderr follows.
+		if (c->errors_to_output && c->errors_first) out += sprintf(out, "2>&1 ");
+		for (int i = 0; i < 5; i++) {
+			if (!c->redirects[i]) continue;
+			out += sprintf(out, "%s ", operators[i]);
+			out = quote_word(out, c->redirects[i]);
+			*out++ = ' ';
+		}
+		if (c->errors_to_output && !c->errors_first) out += sprintf(out, "2>&1 ");
+		if (c->next) out += sprintf(out, "| ");
+	}
+	if (command->background) out += sprintf(out, "&");
+	*out = 0;
+}
+
+int same_string(const char *a, const char *b)
+{
+	return (a == NULL && b == NULL) || (a && b && strcmp(a, b) == 0);
+}
+
+void check(int condition, const char *what, const char *line)
+{
+	if (condition) return;
+	fprintf(stderr, "parse_fuzz: %s for line <%s>\n", what, line);
+	abort();
+}
+
+/**
+ * Stands in for running a $(...), its output is the text inside as written
+ */
+char *substitute_text(char *text, size_t *length)
+{
+	*length = strlen(text);
+	return text;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	substitution_runner = substitute_text;
+
+	// The shell hands the parser a NUL terminated line.
+	char *line = malloc(size + 1);
+	char *copy = malloc(size + 1);
+	memcpy(line, data, size);
+	line[size] = 0;
+	memcpy(copy, line, size + 1);
+
+	struct command_t *first = arena_calloc(&line_arena, sizeof(struct command_t));
+	if (parse_command(line, first) == SUCCESS && !emptyUserInput) {
+		// Quoting can grow a word to four times its size, and file names
+		// matched by wildcards can be longer than the line.
+		size_t needed = 64;
+		for (struct command_t *c = first; c; c = c->next) {
+			for (int i = 0; c->argv[i]; i++) needed += 4 * strlen(c->argv[i]) + 3;
+			for (int i = 0; i < 5; i++) needed += c->redirects[i] ? 4 * strlen(c->redirects[i]) + 8 : 0;
+			needed += 8;
+		}
+		char *again = malloc(needed);
+		unparse(first, again);
+		char *unparsed = strdup(again);
+
+		struct command_t *second = arena_calloc(&line_arena, sizeof(struct command_t));
+		check(parse_command(again, second) == SUCCESS, "reparse failed", copy);
+
+		struct command_t *a = first, *b = second;
+		for (; a && b; a = a->next, b = b->next) {
+			check(strcmp(a->name, b->name) == 0, "names differ", unparsed);
+			check(a->arg_count == b->arg_count, "argument counts differ", unparsed);
+			for (int i = 0; i < a->arg_count; i++)
+				check(strcmp(a->args[i], b->args[i]) == 0, "arguments differ", unparsed);
+			check(a->argv[a->argv[0] ? a->arg_count + 1 : 0] == NULL, "argv not terminated", copy);
+			for (int i = 0; i < 5; i++)
+				check(same_string(a->redirects[i], b->redirects[i]), "redirects differ", unparsed);
+			check(a->errors_to_output == b->errors_to_output, "stderr redirects differ", unparsed);
+			check(!a->errors_to_output || a->errors_first == b->errors_first, "stderr redirect order differs", unparsed);
+			check(a->background == b->background, "background flags differ", unparsed);
+		}
+		check(a == NULL && b == NULL, "stage counts differ", unparsed);
+		free(again);
+		free(unparsed);
+	}
+
+	emptyUserInput = 0;
+	arena_reset(&line_arena);
+	free(line);
+	free(copy);
+	return 0;
+}
+
+#ifndef SEASHELL_LIBFUZZER
+int main(int argc, char **argv)
+{
+	const char *misplaced = builtin_table_check();
+	if (misplaced != NULL) {
+		fprintf(stderr, "parse_fuzz: builtin %s is not in its BUILTIN_HASH slot\n", misplaced);
+		return 1;
+	}
+
+	// Syntax errors are printed to stdout, which is not interesting here.
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+
+	if (argc > 1 && atol(argv[1]) == 0) {
+		for (int i = 1; i < argc; i++) {
+			int fd = open(argv[i], O_RDONLY);
+			struct stat st;
+			if (fd < 0 || fstat(fd, &st) < 0) continue;
+			uint8_t *data = malloc(st.st_size + 1);
+			ssize_t n = read(fd, data, st.st_size);
+			close(fd);
+			LLVMFuzzerTestOneInput(data, n > 0 ? n : 0);
+			free(data);
+		}
+		return 0;
+	}
+
+	// Random lines drawn mostly from characters the parser treats specially,
+	// with $a set to a value that needs quoting and $b set but empty.
+	variable_set("a", "v'a \"l", 0);
+	variable_set("b", "", 0);
+	static const char alphabet[] = " \t\n|&<>2'\"\\$`?ab1{}:-()";
+	long iterations = argc > 1 ? atol(argv[1]) : 100000;
+	uint8_t data[256];
+	srand(1);
+	for (long i = 0; i < iterations; i++) {
+		size_t size = rand() % sizeof(data);
+		for (size_t k = 0; k < size; k++)
+			data[k] = rand() % 8 ? alphabet[rand() % (sizeof(alphabet) - 1)] : rand() % 256;
+		LLVMFuzzerTestOneInput(data, size);
+	}
+	fprintf(stderr, "parse_fuzz: %ld random lines parsed\n", iterations);
+	return 0;
+}
+#endif
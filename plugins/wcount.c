@@ -0,0 +1,129 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Example plugin: wcount, a small wc. Counts lines, words and bytes of files,
+// or of stdin without any. -l, -w and -c pick the counts to print.
+//
+// As a plugin:   gcc -O2 -shared -fPIC -o plugins/wcount.so plugins/wcount.c
+//                enable -f ./plugins/wcount.so wcount
+// As a program:  gcc -O2 -DWCOUNT_MAIN -o plugins/wcount plugins/wcount.c
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../seashell_plugin.h"
+
+struct counts_t {
+	unsigned long long lines;
+	unsigned long long words;
+	unsigned long long bytes;
+};
+
+int count_fd(int fd, struct counts_t *counts)
+{
+	static char buffer[1 << 16];
+	int in_word = 0;
+	ssize_t n;
+	while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		counts->bytes += n;
+		for (ssize_t i = 0; i < n; i++) {
+			unsigned char c = buffer[i];
+			int space = c == ' ' || (c >= '\t' && c <= '\r');
+			if (c == '\n') counts->lines++;
+			if (!space && !in_word) counts->words++;
+			in_word = !space;
+		}
+	}
+	return 0;
+}
+
+void print_counts(int fd, const char *which, struct counts_t *counts, const char *name)
+{
+	char line[128];
+	int length = 0;
+	if (strchr(which, 'l')) length += snprintf(line + length, sizeof(line) - length, "%8llu", counts->lines);
+	if (strchr(which, 'w')) length += snprintf(line + length, sizeof(line) - length, "%8llu", counts->words);
+	if (strchr(which, 'c')) length += snprintf(line + length, sizeof(line) - length, "%8llu", counts->bytes);
+	length += snprintf(line + length, sizeof(line) - length, "%s%s\n", name ? " " : "", name ? name : "");
+	write(fd, line, length);
+}
+
+int wcount_run(int argc, char **argv, const struct seashell_io_t *io)
+{
+	char which[4] = "";
+	int first = 1;
+	for (; first < argc && argv[first][0] == '-' && argv[first][1]; first++) {
+		for (char *p = argv[first] + 1; *p; p++) {
+			if (!strchr("lwc", *p)) {
+				dprintf(io->err, "wcount: invalid option -- '%c'\nUsage: wcount [-lwc] [file ...]\n", *p);
+				return 2;
+			}
+			if (!strchr(which, *p)) strncat(which, p, 1);
+		}
+	}
+	if (which[0] == 0) strcpy(which, "lwc");
+
+	if (first == argc) {
+		struct counts_t counts = { 0, 0, 0 };
+		if (count_fd(io->in, &counts) < 0) {
+			dprintf(io->err, "wcount: %s\n", strerror(errno));
+			return 1;
+		}
+		print_counts(io->out, which, &counts, NULL);
+		return 0;
+	}
+
+	struct counts_t total = { 0, 0, 0 };
+	int status = 0;
+	for (int i = first; i < argc; i++) {
+		struct counts_t counts = { 0, 0, 0 };
+		int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || count_fd(fd, &counts) < 0) {
+			dprintf(io->err, "wcount: %s: %s\n", argv[i], strerror(errno));
+			if (fd >= 0) close(fd);
+			status = 1;
+			continue;
+		}
+		close(fd);
+		print_counts(io->out, which, &counts, argv[i]);
+		total.lines += counts.lines;
+		total.words += counts.words;
+		total.bytes += counts.bytes;
+	}
+	if (argc - first > 1) print_counts(io->out, which, &total, "total");
+	return status;
+}
+
+void wcount_complete(int argc, char **argv, const char *word,
+		void (*add)(void *context, const char *candidate), void *context)
+{
+	static const char *const options[] = { "-l", "-w", "-c" };
+	if (word[0] != '-') return;
+	for (int i = 0; i < 3; i++)
+		if (strncmp(options[i], word, strlen(word)) == 0) add(context, options[i]);
+}
+
+const struct seashell_builtin_t wcount_builtins[] = {
+	{ "wcount", "wcount [-lwc] [file ...]", wcount_run, wcount_complete },
+};
+
+const struct seashell_plugin_t seashell_plugin = {
+	SEASHELL_PLUGIN_VERSION,
+	sizeof(struct seashell_plugin_t),
+	wcount_builtins,
+	1,
+};
+
+#ifdef WCOUNT_MAIN
+int main(int argc, char **argv)
+{
+	struct seashell_io_t io = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	return wcount_run(argc, argv, &io);
+}
+#endif
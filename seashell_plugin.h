@@ -0,0 +1,54 @@
+// Authors: Kaan Turkmen - Eren Yenigul.
+
+// Interface for builtins loaded at run time with `enable -f plugin.so name`.
+// A plugin is a shared object that exports `seashell_plugin`, a struct
+// seashell_plugin_t listing the builtins it provides. The shell only reads
+// the structures below, so a plugin does not link against the shell and
+// keeps working across shell versions with the same SEASHELL_PLUGIN_VERSION.
+//
+// Fields are only ever added at the end; `size` tells the shell how much of
+// the struct a plugin was built with.
+
+#ifndef SEASHELL_PLUGIN_H
+#define SEASHELL_PLUGIN_H
+
+#include <stddef.h>
+
+#define SEASHELL_PLUGIN_VERSION 1
+
+// Descriptors a builtin reads from and writes to, with the command's
+// redirections and pipes already applied.
+struct seashell_io_t {
+	int in;
+	int out;
+	int err;
+};
+
+struct seashell_builtin_t {
+	const char *name;
+	const char *help; // one line usage, printed by `enable` and on bad arguments
+
+	/**
+	 * Runs the builtin inside the shell's process
+	 * @param argc number of words, the name included
+	 * @param argv the words, NULL terminated
+	 * @return exit status
+	 */
+	int (*run)(int argc, char **argv, const struct seashell_io_t *io);
+
+	/**
+	 * Optional. Offers completions for the word being typed after argv;
+	 * add is called once per candidate with the context it was given.
+	 */
+	void (*complete)(int argc, char **argv, const char *word,
+			void (*add)(void *context, const char *candidate), void *context);
+};
+
+struct seashell_plugin_t {
+	unsigned int version; // SEASHELL_PLUGIN_VERSION
+	size_t size; // sizeof(struct seashell_plugin_t)
+	const struct seashell_builtin_t *builtins;
+	int builtin_count;
+};
+
+#endif